@@ -1,10 +1,26 @@
 #include "critter/webserver.h"
 
-int main(int, const char**)
+int main(int argc, const char** argv)
 {
     critter::WebServer server;
-    server.listen(8888);
-    server.listen(critter::SslOptions({"./cert.pem", "./key.pem"}), 8889);
+    // pass "thread_pool" or "io_uring" to compare the file I/O backends,
+    // then a number of worker processes to run in prefork mode
+    try {
+        if (argc > 1 && std::string(argv[1]) == "thread_pool")
+            server.set_file_io(critter::FileIo::thread_pool);
+        else if (argc > 1 && std::string(argv[1]) == "io_uring")
+            server.set_file_io(critter::FileIo::io_uring);
+    } catch (const std::invalid_argument& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    try {
+        server.listen(8888);
+        server.listen(critter::SslOptions({"./cert.pem", "./key.pem"}), 8889);
+    } catch (const std::exception& e) {
+        std::cerr << "listen: " << e.what() << std::endl;
+        return 1;
+    }
     server.add_http_handler(http::verb::get, "/test/?", [](auto&& req)
     {
         return "Hello\n";
@@ -14,14 +30,35 @@ int main(int, const char**)
         std::cout << req.body() << std::endl;
         return "ok\n";
     });
-    server.add_ws_handler("/ws(/.*)?", [&](auto msg, auto& session) {
+    critter::CacheOptions cache_options;
+    cache_options.ttl = std::chrono::seconds(2);
+    cache_options.stale_while_revalidate = std::chrono::seconds(10);
+    server.add_cached_http_handler("/slow/?", cache_options, [](auto&&)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        return "Computed\n";
+    });
+    server.add_static_response(http::verb::get, "/health/?", "ok\n");
+    server.add_ws_handler("/ws(/.*)?", [&](auto msg, auto&) {
         std::cout << msg << std::endl;
         // echo the message to all clients
-        for(auto& session: server.get_ws_sessions()) session->send(msg);
+        server.broadcast(msg);
     });
     server.serve_files("/", "./www/");
 
     std::cout << "Server started" << std::endl; 
-    server.run();
+#ifdef __linux__
+    if (argc > 2)
+    {
+        try {
+            server.run_workers(std::stoi(argv[2]));
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+    else
+#endif
+        server.run();
     return 0;
 }
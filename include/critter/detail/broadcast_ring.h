@@ -0,0 +1,237 @@
+#pragma once
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+namespace critter::detail
+{
+
+const auto BROADCAST_RING_SLOTS = 1024;
+const auto BROADCAST_SLOT_SIZE = 4096 - 64;
+// Larger messages are split over consecutive slots, up to a quarter of the ring.
+const auto MAX_BROADCAST_SIZE = BROADCAST_SLOT_SIZE * (BROADCAST_RING_SLOTS / 4);
+// A slot still unpublished after this long is assumed to belong to a dead writer.
+const auto BROADCAST_WRITE_TIMEOUT = std::chrono::milliseconds(500);
+
+// Lock-free ring of broadcast messages in anonymous shared memory, with one
+// eventfd per reader to wake it up. It is created before forking the
+// workers: any process may publish, and every process reads every message
+// with its own Reader.
+// There is no back-pressure: a reader that falls more than a full ring
+// behind, or that waits on a slot whose writer died, skips the lost
+// messages. Two writers a full ring apart can still write the same slot at
+// once (1024 slots published during one copy); readers do not detect the
+// resulting torn message.
+class BroadcastRing
+{
+    using clock = std::chrono::steady_clock;
+
+public:
+    struct Reader
+    {
+        explicit Reader(std::uint64_t cursor): cursor(cursor) {}
+
+        std::uint64_t cursor;
+        std::string message;
+        bool assembling = false;
+        std::uint64_t message_first = 0;
+        bool waiting = false;
+        clock::time_point waiting_since;
+    };
+
+    // Throws std::runtime_error where 64-bit atomics are not lock-free:
+    // libatomic's locks are not shared between processes.
+    explicit BroadcastRing(unsigned nb_readers)
+    {
+        if(!std::atomic<std::uint64_t>::is_always_lock_free)
+            throw std::runtime_error("prefork mode needs lock-free 64-bit atomics");
+
+        void* p = ::mmap(nullptr, sizeof(Shared), PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if(p == MAP_FAILED)
+            throw std::system_error(errno, std::generic_category(), "mmap");
+        shared_ = new (p) Shared();
+
+        for(auto i = nb_readers; i > 0; --i)
+        {
+            int fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if(fd < 0)
+            {
+                auto error = errno;
+                close_all();
+                throw std::system_error(error, std::generic_category(), "eventfd");
+            }
+            events_.push_back(fd);
+        }
+    }
+
+    ~BroadcastRing()
+    {
+        close_all();
+    }
+
+    BroadcastRing(const BroadcastRing&) = delete;
+    BroadcastRing& operator=(const BroadcastRing&) = delete;
+
+    // Readable whenever messages were published since it was last read.
+    int event_fd(unsigned reader) const { return events_.at(reader); }
+
+    Reader make_reader() const { return Reader(head()); }
+
+    void publish(std::string_view msg)
+    {
+        if(msg.size() > MAX_BROADCAST_SIZE)
+            throw std::length_error("broadcast message too large");
+
+        std::uint64_t count = std::max<std::size_t>(1, (msg.size() + BROADCAST_SLOT_SIZE - 1) / BROADCAST_SLOT_SIZE);
+        auto first = shared_->head.fetch_add(count, std::memory_order_relaxed);
+        for(std::uint64_t i = 0; i < count; ++i)
+        {
+            auto seq = first + i;
+            auto& slot = shared_->slots[seq % BROADCAST_RING_SLOTS];
+            auto chunk = msg.substr(i * BROADCAST_SLOT_SIZE, BROADCAST_SLOT_SIZE);
+            slot.seq.store(WRITING, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            slot.first = first;
+            slot.last = i + 1 == count;
+            slot.size = static_cast<std::uint32_t>(chunk.size());
+            std::memcpy(slot.data, chunk.data(), chunk.size());
+            slot.seq.store(seq + 1, std::memory_order_release);
+        }
+
+        std::uint64_t one = 1;
+        for(auto fd: events_)
+            (void)!::write(fd, &one, sizeof(one));
+    }
+
+    std::uint64_t head() const
+    {
+        return shared_->head.load(std::memory_order_acquire);
+    }
+
+    // Calls f with every complete message published since the reader's
+    // cursor, advancing it. Returns true when it stopped on a slot that is
+    // still being written: call again shortly, no event will signal it.
+    template<class F>
+    bool drain(Reader& r, F&& f) const
+    {
+        for(;;)
+        {
+            auto head = this->head();
+            if(r.cursor >= head)
+                return false;
+            if(head - r.cursor > BROADCAST_RING_SLOTS)
+            {
+                r.cursor = head - BROADCAST_RING_SLOTS;
+                r.assembling = false;
+                r.waiting = false;
+            }
+
+            auto& slot = shared_->slots[r.cursor % BROADCAST_RING_SLOTS];
+            auto seq = slot.seq.load(std::memory_order_acquire);
+            if(seq != r.cursor + 1)
+            {
+                if(seq != WRITING && seq > r.cursor + 1)
+                {
+                    skip(r);    // overwritten by a later lap
+                    continue;
+                }
+                auto now = clock::now();
+                if(!r.waiting)
+                {
+                    r.waiting = true;
+                    r.waiting_since = now;
+                }
+                if(now - r.waiting_since < BROADCAST_WRITE_TIMEOUT)
+                    return true;
+                skip(r);        // its writer is gone
+                continue;
+            }
+
+            auto first = slot.first;
+            bool last = slot.last;
+            auto size = std::min<std::size_t>(slot.size, BROADCAST_SLOT_SIZE);
+            bool starts = first == r.cursor;
+            bool continues = r.assembling && first == r.message_first;
+            auto kept = r.message.size();
+            if(starts)
+                r.message.assign(slot.data, size);
+            else if(continues)
+                r.message.append(slot.data, size);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(slot.seq.load(std::memory_order_relaxed) != seq)
+            {
+                if(continues) r.message.resize(kept);
+                continue;       // overwritten while copying
+            }
+
+            ++r.cursor;
+            r.waiting = false;
+            if(starts)
+            {
+                r.assembling = true;
+                r.message_first = first;
+            }
+            else if(!continues)
+                continue;       // rest of a message whose start was lost
+            if(last)
+            {
+                r.assembling = false;
+                f(std::string_view(r.message));
+            }
+        }
+    }
+
+private:
+    static constexpr std::uint64_t WRITING = ~std::uint64_t(0);
+
+    struct alignas(64) Slot
+    {
+        std::atomic<std::uint64_t> seq{0};
+        std::uint64_t first = 0;    // seq of the message's first slot
+        std::uint32_t size = 0;
+        bool last = false;
+        char data[BROADCAST_SLOT_SIZE];
+    };
+
+    struct Shared
+    {
+        alignas(64) std::atomic<std::uint64_t> head{0};
+        Slot slots[BROADCAST_RING_SLOTS];
+    };
+
+    static void skip(Reader& r)
+    {
+        ++r.cursor;
+        r.assembling = false;
+        r.waiting = false;
+    }
+
+    void close_all()
+    {
+        for(auto fd: events_)
+            ::close(fd);
+        events_.clear();
+        if(shared_)
+            ::munmap(shared_, sizeof(Shared));
+        shared_ = nullptr;
+    }
+
+    Shared* shared_ = nullptr;
+    std::vector<int> events_;
+};
+
+}
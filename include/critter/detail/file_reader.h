@@ -0,0 +1,223 @@
+#pragma once
+
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/system/error_code.hpp>
+#include <fstream>
+#include <string>
+
+// Asio only provides file objects, and only routes them through io_uring,
+// when built with BOOST_ASIO_HAS_IO_URING (Boost >= 1.78, linked with liburing).
+#if defined(BOOST_ASIO_HAS_IO_URING) && defined(BOOST_ASIO_HAS_FILE)
+#   define CRITTER_HAS_IO_URING 1
+#   include <boost/asio/io_context.hpp>
+#   include <boost/asio/random_access_file.hpp>
+#   include <boost/asio/read_at.hpp>
+#   include <liburing.h>
+#   include <fcntl.h>
+#   include <sys/stat.h>
+#   include <unistd.h>
+#endif
+
+namespace critter::detail
+{
+
+// Runs f(ec) on pool, then completes token with its error and result on
+// the caller's own executor.
+template<class Result, class F, class CompletionToken>
+auto async_run_on(boost::asio::thread_pool& pool, F f, CompletionToken&& token)
+{
+    return boost::asio::async_initiate<CompletionToken, void(boost::system::error_code, Result)>(
+        [&pool](auto handler, F f)
+        {
+            auto work = boost::asio::make_work_guard(handler);
+            boost::asio::post(pool,
+                [handler=std::move(handler), work=std::move(work), f=std::move(f)]() mutable
+                {
+                    boost::system::error_code ec;
+                    Result result = f(ec);
+                    auto ex = work.get_executor();
+                    boost::asio::post(ex,
+                        [handler=std::move(handler), ec, result=std::move(result)]() mutable
+                        {
+                            handler(ec, std::move(result));
+                        });
+                    work.reset();
+                });
+        },
+        token, std::move(f));
+}
+
+// Reads whole files on behalf of a connection coroutine. The calling
+// coroutine is suspended until the data is ready, so a slow disk never
+// stalls the other connections served by the same io_context thread.
+class FileReader
+{
+public:
+    virtual ~FileReader() = default;
+
+    // Sets ec to no_such_file_or_directory when the file cannot be opened
+    // and to file_too_large when it is bigger than max_size.
+    virtual std::string read(const std::string& path, std::size_t max_size,
+                             boost::asio::yield_context yield,
+                             boost::system::error_code& ec) = 0;
+};
+
+// Performs the blocking reads on a small dedicated pool of threads and
+// resumes the coroutine on its own executor once done.
+class ThreadPoolFileReader : public FileReader
+{
+public:
+    explicit ThreadPoolFileReader(std::size_t nb_threads=2)
+        : pool_(nb_threads)
+    {
+    }
+
+    ~ThreadPoolFileReader()
+    {
+        pool_.join();
+    }
+
+    template<class CompletionToken>
+    auto async_read(std::string path, std::size_t max_size, CompletionToken&& token)
+    {
+        return async_run_on<std::string>(pool_,
+            [path=std::move(path), max_size](boost::system::error_code& ec) {
+                return read_file(path, max_size, ec);
+            },
+            std::forward<CompletionToken>(token));
+    }
+
+    std::string read(const std::string& path, std::size_t max_size,
+                     boost::asio::yield_context yield,
+                     boost::system::error_code& ec) override
+    {
+        return async_read(path, max_size, yield[ec]);
+    }
+
+private:
+    static std::string read_file(const std::string& path, std::size_t max_size,
+                                 boost::system::error_code& ec)
+    {
+        std::ifstream file(path.c_str(), std::ios::binary);
+        if (!file)
+        {
+            ec = make_error_code(boost::system::errc::no_such_file_or_directory);
+            return {};
+        }
+        file.seekg(0, std::ios::end);
+        auto size = static_cast<std::size_t>(file.tellg());
+        if (size > max_size)
+        {
+            ec = make_error_code(boost::system::errc::file_too_large);
+            return {};
+        }
+
+        std::string str;
+        str.reserve(size);
+
+        file.seekg(0, std::ios::beg);
+        str.assign((std::istreambuf_iterator<char>(file)),
+                    std::istreambuf_iterator<char>());
+        return str;
+    }
+
+    boost::asio::thread_pool pool_;
+};
+
+#ifdef CRITTER_HAS_IO_URING
+
+// Returns whether the running kernel lets us create an io_uring instance.
+// Goes through liburing, like Asio: <linux/io_uring.h> shares its include
+// guard with liburing's own copy, and may be older.
+inline bool io_uring_supported()
+{
+    io_uring ring;
+    if (::io_uring_queue_init(1, &ring, 0) < 0) return false;
+    ::io_uring_queue_exit(&ring);
+    return true;
+}
+
+// Submits the reads through Asio's io_uring backend, from the io_context
+// that owns the connection. Asio's file objects open and stat synchronously,
+// so those two calls, the slow ones on network volumes, run on a small pool.
+class UringFileReader : public FileReader
+{
+public:
+    explicit UringFileReader(boost::asio::io_context::executor_type ex, std::size_t nb_threads=1)
+        : ex_(std::move(ex)), pool_(nb_threads)
+    {
+    }
+
+    ~UringFileReader()
+    {
+        pool_.join();
+    }
+
+    std::string read(const std::string& path, std::size_t max_size,
+                     boost::asio::yield_context yield,
+                     boost::system::error_code& ec) override
+    {
+        auto opened = async_run_on<OpenFile>(pool_,
+            [path, max_size](boost::system::error_code& ec) { return open_file(path, max_size, ec); },
+            yield[ec]);
+        if (ec) return {};
+
+        boost::asio::random_access_file file(ex_);
+        file.assign(opened.fd, ec);
+        if (ec)
+        {
+            ::close(opened.fd);
+            return {};
+        }
+
+        std::string str(opened.size, '\0');
+        auto n = boost::asio::async_read_at(file, 0, boost::asio::buffer(str), yield[ec]);
+        if (ec == boost::asio::error::eof) ec = {};
+        str.resize(n);
+        return str;
+    }
+
+private:
+    struct OpenFile
+    {
+        int fd = -1;
+        std::size_t size = 0;
+    };
+
+    static OpenFile open_file(const std::string& path, std::size_t max_size,
+                              boost::system::error_code& ec)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            ec = make_error_code(boost::system::errc::no_such_file_or_directory);
+            return {};
+        }
+        struct stat st;
+        if (::fstat(fd, &st) < 0)
+        {
+            ec = boost::system::error_code(errno, boost::system::generic_category());
+            ::close(fd);
+            return {};
+        }
+        if (static_cast<std::size_t>(st.st_size) > max_size)
+        {
+            ec = make_error_code(boost::system::errc::file_too_large);
+            ::close(fd);
+            return {};
+        }
+        return {fd, static_cast<std::size_t>(st.st_size)};
+    }
+
+    boost::asio::io_context::executor_type ex_;
+    boost::asio::thread_pool pool_;
+};
+
+#endif
+
+}
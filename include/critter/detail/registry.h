@@ -1,7 +1,12 @@
+#pragma once
+
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
+#include <boost/asio/spawn.hpp>
 #include <stdexcept>
+#include <sstream>
+#include <string>
 #include <vector>
 #include <tuple>
 #include <regex>
@@ -27,13 +32,46 @@ inline auto make_response(std::string response)
 inline auto make_response(const char* response) { return make_response(std::string(response)); }
 inline auto make_response(std::string_view response) { return make_response(std::string(response)); }
 
+// A response serialized once, at registration. Only the keep-alive or
+// close variant is chosen per request.
+class StaticResponse
+{
+public:
+    explicit StaticResponse(http::response<http::string_body> res)
+    {
+        res.version(11);
+        res.prepare_payload();
+        res.set(http::field::connection, "keep-alive");
+        keep_alive_ = serialize(res);
+        res.set(http::field::connection, "close");
+        close_ = serialize(res);
+    }
+
+    boost::asio::const_buffer buffer(bool keep_alive) const
+    {
+        return boost::asio::buffer(keep_alive ? keep_alive_ : close_);
+    }
+
+private:
+    static std::string serialize(const http::response<http::string_body>& res)
+    {
+        std::ostringstream os;
+        os << res;
+        return os.str();
+    }
+
+    std::string keep_alive_;
+    std::string close_;
+};
+
 class WebSocketSession;
 using HttpHandler = std::function<http::response<http::string_body>(http::request<http::string_body>&&)>;
 using WebSocketHandler = std::function<void(std::string_view, WebSocketSession&)>;
+using AsyncHttpHandler = std::function<http::response<http::string_body>(http::request<http::string_body>&&, boost::asio::yield_context)>;
 
 class Registry
 {
-    using Handler = std::variant<HttpHandler, WebSocketHandler>;
+    using Handler = std::variant<HttpHandler, WebSocketHandler, AsyncHttpHandler, StaticResponse>;
     using Entry = std::tuple<http::verb, std::regex, Handler>;
 public:
 
@@ -51,6 +89,16 @@ public:
         resource_table.emplace_back(std::move(v), std::regex(uri.begin(), uri.end()), Handler(f));
     }
 
+    void add(http::verb v, boost::beast::string_view uri, AsyncHttpHandler f)
+    {
+        resource_table.emplace_back(std::move(v), std::regex(uri.begin(), uri.end()), Handler(f));
+    }
+
+    void add(http::verb v, boost::beast::string_view uri, StaticResponse r)
+    {
+        resource_table.emplace_back(std::move(v), std::regex(uri.begin(), uri.end()), Handler(std::move(r)));
+    }
+
     const Handler& get(http::verb verb, boost::beast::string_view uri) const
     {
         auto pred = [&](const auto& entry){
@@ -0,0 +1,229 @@
+#pragma once
+
+#include "registry.h"
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/spawn.hpp>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace critter::detail
+{
+
+// Caches the responses of an idempotent handler, keyed by target plus the
+// selected request headers. Entries live for `ttl`, may then be served for
+// `stale_while_revalidate` more while one refresh runs in the background
+// (handed to `schedule`, which must not run it on an io_context thread),
+// and are evicted least recently used first beyond `max_bytes`.
+// Concurrent misses for the same key share a single handler invocation:
+// the first request runs it, the others suspend until it is done.
+class ResponseCache : public std::enable_shared_from_this<ResponseCache>
+{
+    using clock = std::chrono::steady_clock;
+    using Request = http::request<http::string_body>;
+    using Response = http::response<http::string_body>;
+
+public:
+    using Scheduler = std::function<void(std::function<void()>)>;
+
+    ResponseCache(Scheduler schedule,
+                  HttpHandler handler,
+                  clock::duration ttl,
+                  clock::duration stale_while_revalidate,
+                  std::size_t max_bytes,
+                  std::vector<std::string> vary)
+        : schedule_(std::move(schedule)), handler_(std::move(handler)), ttl_(ttl),
+          stale_while_revalidate_(stale_while_revalidate),
+          max_bytes_(max_bytes), vary_(std::move(vary))
+    {
+    }
+
+    Response operator()(Request&& req, boost::asio::yield_context yield)
+    {
+        auto key = make_key(req);
+        auto version = req.version();
+        auto keep_alive = req.keep_alive();
+        std::shared_ptr<Flight> flight;
+        bool leader = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto now = clock::now();
+            auto found = entries_.find(key);
+            if(found != entries_.end() && now < found->second.stored + ttl_ + stale_while_revalidate_)
+            {
+                auto& entry = found->second;
+                lru_.splice(lru_.begin(), lru_, entry.lru);
+                if(now >= entry.stored + ttl_ && flights_.find(key) == flights_.end())
+                {
+                    // Serve stale and refresh once, after this request is answered
+                    auto refresh = std::make_shared<Flight>();
+                    flights_.emplace(key, refresh);
+                    schedule_([this, self=shared_from_this(), key, refresh, req=req]() mutable {
+                        fill(key, *refresh, std::move(req));
+                    });
+                }
+                return respond(*entry.response, version, keep_alive);
+            }
+
+            auto& slot = flights_[key];
+            if(!slot)
+            {
+                slot = std::make_shared<Flight>();
+                leader = true;
+            }
+            flight = slot;
+        }
+
+        if(leader)
+            fill(key, *flight, std::move(req));
+        else
+            wait(*flight, yield);
+
+        if(flight->error) std::rethrow_exception(flight->error);
+        return respond(*flight->response, version, keep_alive);
+    }
+
+private:
+    struct Flight
+    {
+        bool done = false;
+        std::shared_ptr<const Response> response;
+        std::exception_ptr error;
+        std::vector<std::function<void()>> waiters;
+    };
+
+    struct Entry
+    {
+        std::shared_ptr<const Response> response;
+        clock::time_point stored;
+        std::size_t bytes;
+        std::list<std::string>::iterator lru;
+    };
+
+    // Copies a shared response for one requester, with its own version and
+    // keep-alive rather than those of the request that produced it.
+    static Response respond(const Response& shared, unsigned version, bool keep_alive)
+    {
+        Response res = shared;
+        res.version(version);
+        res.keep_alive(keep_alive);
+        return res;
+    }
+
+    std::string make_key(const Request& req) const
+    {
+        std::string key = req.target().to_string();
+        for(const auto& name: vary_)
+        {
+            key += '\0';
+            key += req[name].to_string();
+        }
+        return key;
+    }
+
+    // Runs the handler for a flight, publishes the result and wakes its waiters.
+    void fill(const std::string& key, Flight& flight, Request&& req)
+    {
+        std::shared_ptr<const Response> response;
+        std::exception_ptr error;
+        try {
+            response = std::make_shared<const Response>(handler_(std::move(req)));
+        } catch(...) {
+            error = std::current_exception();
+        }
+
+        std::vector<std::function<void()>> waiters;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            flight.response = response;
+            flight.error = error;
+            flight.done = true;
+            waiters.swap(flight.waiters);
+            flights_.erase(key);
+            if(response && response->result() == http::status::ok)
+                store(key, std::move(response));
+        }
+        for(auto& w: waiters) w();
+    }
+
+    // Suspends the calling coroutine until the flight is done.
+    void wait(Flight& flight, boost::asio::yield_context yield)
+    {
+        boost::asio::async_initiate<boost::asio::yield_context, void(boost::system::error_code)>(
+            [this, &flight](auto handler)
+            {
+                auto h = std::make_shared<decltype(handler)>(std::move(handler));
+                auto work = boost::asio::make_work_guard(*h);
+                auto resume = [h, work]() mutable {
+                    auto ex = work.get_executor();
+                    boost::asio::post(ex, [h]() { (*h)(boost::system::error_code{}); });
+                    work.reset();
+                };
+                std::unique_lock<std::mutex> lock(mutex_);
+                if(flight.done)
+                {
+                    lock.unlock();
+                    resume();
+                }
+                else
+                    flight.waiters.push_back(std::move(resume));
+            },
+            yield);
+    }
+
+    static std::size_t header_size(const Response& response)
+    {
+        std::ostringstream os;
+        os << response.base();
+        return os.str().size();
+    }
+
+    // Must be called with mutex_ held.
+    void store(const std::string& key, std::shared_ptr<const Response> response)
+    {
+        auto bytes = key.size() + header_size(*response) + response->body().size();
+        if(bytes > max_bytes_) return;
+
+        auto found = entries_.find(key);
+        if(found != entries_.end())
+        {
+            total_bytes_ -= found->second.bytes;
+            lru_.erase(found->second.lru);
+            entries_.erase(found);
+        }
+        while(total_bytes_ + bytes > max_bytes_ && !lru_.empty())
+        {
+            auto victim = entries_.find(lru_.back());
+            total_bytes_ -= victim->second.bytes;
+            entries_.erase(victim);
+            lru_.pop_back();
+        }
+        lru_.push_front(key);
+        entries_.emplace(key, Entry{std::move(response), clock::now(), bytes, lru_.begin()});
+        total_bytes_ += bytes;
+    }
+
+    Scheduler schedule_;
+    HttpHandler handler_;
+    clock::duration ttl_;
+    clock::duration stale_while_revalidate_;
+    std::size_t max_bytes_;
+    std::vector<std::string> vary_;
+
+    std::mutex mutex_;
+    std::unordered_map<std::string, Entry> entries_;
+    std::unordered_map<std::string, std::shared_ptr<Flight>> flights_;
+    std::list<std::string> lru_;
+    std::size_t total_bytes_ = 0;
+};
+
+}
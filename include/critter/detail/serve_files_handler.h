@@ -13,6 +13,7 @@
 //
 //------------------------------------------------------------------------------
 
+#include "file_reader.h"
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
@@ -21,7 +22,6 @@
 #include <memory>
 #include <string>
 #include <thread>
-#include <fstream>
 #include <regex>
 
 namespace critter::detail
@@ -98,11 +98,14 @@ path_cat(
 }
 
 // This function produces an HTTP response for the given request. 
+// The file is read through `reader`, suspending the calling coroutine.
 inline http::response<http::string_body>
 serve_file_from(
     boost::beast::string_view doc_root,
     boost::beast::string_view uri_regex,
-    http::request<http::string_body>&& req)
+    http::request<http::string_body>&& req,
+    FileReader& reader,
+    boost::asio::yield_context yield)
 {
     // Returns a bad request response
     auto const bad_request =
@@ -165,26 +168,21 @@ serve_file_from(
     if(req.target().back() == '/')
         path.append("index.html");
 
-    // Attempt to open the file
-    std::ifstream file(path.c_str());
-    if (!file) return not_found(req.target());
-    file.seekg(0, std::ios::end);
-    if (file.tellg() > MAX_FILE_SIZE) {
+    // Attempt to read the file
+    boost::system::error_code ec;
+    std::string str = reader.read(path, MAX_FILE_SIZE, yield, ec);
+    if (ec == boost::system::errc::no_such_file_or_directory)
+        return not_found(req.target());
+    if (ec == boost::system::errc::file_too_large)
         return server_error("file too big");
-    }
-
-    std::string str;
-    str.reserve(file.tellg());
-
-    file.seekg(0, std::ios::beg);
-    str.assign((std::istreambuf_iterator<char>(file)),
-                std::istreambuf_iterator<char>());
+    if (ec)
+        return server_error(ec.message());
 
     // Respond to GET request
     http::response<http::string_body> res{http::status::ok, req.version()};
     res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
     res.set(http::field::content_type, mime_type(path));
-    res.body() = str;
+    res.body() = std::move(str);
     res.keep_alive(req.keep_alive());
     res.prepare_payload();
     return std::move(res);
@@ -2,7 +2,9 @@
 
 #define BOOST_COROUTINES_NO_DEPRECATION_WARNING
 
+#include "detail/file_reader.h"
 #include "detail/registry.h"
+#include "detail/response_cache.h"
 #include "detail/serve_files_handler.h"
 #include "detail/websocket_session.h"
 #include <boost/beast/websocket.hpp>
@@ -14,8 +16,13 @@
 #include <boost/asio/ssl.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/asio/write.hpp>
 #include <boost/system/system_error.hpp>
 #include <algorithm>
+#include <chrono>
+#include <functional>
 #include <memory>
 #include <string>
 #include <thread>
@@ -23,6 +30,20 @@
 #include <mutex>
 #include <stdexcept>
 
+#ifdef __linux__
+#   include "detail/broadcast_ring.h"
+#   include <boost/asio/posix/stream_descriptor.hpp>
+#   include <boost/asio/signal_set.hpp>
+#   include <pthread.h>
+#   include <signal.h>
+#   include <sys/prctl.h>
+#   include <sys/wait.h>
+#   include <unistd.h>
+#   include <csignal>
+#   include <cstdio>
+#   include <map>
+#endif
+
 namespace critter
 {
 
@@ -44,6 +65,23 @@ private:
 using Request=http::request<http::string_body>;
 using Response=http::response<http::string_body>;
 
+// Backend used by serve_files() to read files off the io_context threads.
+enum class FileIo
+{
+    automatic,   // io_uring when compiled in and supported by the kernel, thread pool otherwise
+    thread_pool,
+    io_uring
+};
+
+// Options of a cached route, see add_cached_http_handler().
+struct CacheOptions
+{
+    std::chrono::milliseconds ttl{1000};
+    std::chrono::milliseconds stale_while_revalidate{0};
+    std::size_t max_bytes = 16 * 1024 * 1024;
+    std::vector<std::string> vary;  // names of the request headers that are part of the cache key
+};
+
 struct SslOptions
 {
     std::string certificate_file_path;
@@ -69,14 +107,15 @@ public:
         listen(sslOptions, port);
     }
 
+    // Binds the port right away: errors are thrown from here, and prefork
+    // workers inherit the listening socket.
     void listen(unsigned short port=80)
     {
         auto const address = boost::asio::ip::address::from_string("::");
         boost::asio::spawn(ioc,
             std::bind(
                 &WebServer::do_listen<tcp::socket>, this,
-                std::ref(ioc),
-                tcp::endpoint{address, port},
+                open_acceptor(tcp::endpoint{address, port}),
                 std::placeholders::_1));
     }
 
@@ -93,8 +132,7 @@ public:
         boost::asio::spawn(ioc,
             std::bind(
                 &WebServer::do_listen<boost::beast::ssl_stream<tcp::socket>>, this,
-                std::ref(ioc),
-                tcp::endpoint{address, port},
+                open_acceptor(tcp::endpoint{address, port}),
                 std::placeholders::_1));
     }
 
@@ -110,9 +148,26 @@ public:
         base_uri += "(/.*)";
         std::string path = local_path.to_string();
         registry_.add(http::verb::get, base_uri,
-            [=](http::request<http::string_body>&& req) -> http::response<http::string_body> {
-                return detail::serve_file_from(path, base_uri, std::move(req));
-            });
+            detail::AsyncHttpHandler([=](http::request<http::string_body>&& req, boost::asio::yield_context yield) {
+                return detail::serve_file_from(path, base_uri, std::move(req), *file_reader_, yield);
+            }));
+    }
+
+    // Selects how served files are read. Must be called before start()/run().
+    // nb_threads sizes the file I/O thread pool, which only opens files
+    // with io_uring. Throws std::invalid_argument if io_uring is requested
+    // but not compiled in or refused by the kernel.
+    void set_file_io(FileIo backend, unsigned nb_threads=2)
+    {
+#ifdef CRITTER_HAS_IO_URING
+        if(backend == FileIo::io_uring && !detail::io_uring_supported())
+            throw std::invalid_argument("io_uring file I/O is not supported by the running kernel");
+#else
+        if(backend == FileIo::io_uring)
+            throw std::invalid_argument("io_uring file I/O is not available in this build");
+#endif
+        file_io_ = backend;
+        file_io_threads_ = nb_threads;
     }
 
     template<class F>
@@ -121,6 +176,40 @@ public:
         registry_.add(v, uri_regex, [f=std::move(f)] (auto&& r) {return detail::make_response(f(std::move(r)));});
     }
 
+    // Like add_http_handler() for GET, but caches the responses per target
+    // (plus options.vary headers). Concurrent misses run the handler once.
+    // With a non-zero stale_while_revalidate, refreshes run f on the refresh
+    // thread pool, concurrently with the io_context threads and with each
+    // other even under run(): f must then be thread-safe.
+    template<class F>
+    void add_cached_http_handler(boost::beast::string_view uri_regex, const CacheOptions& options, F&& f)
+    {
+        auto cache = std::make_shared<detail::ResponseCache>(
+            [this](std::function<void()> refresh) { boost::asio::post(*refresh_pool_, std::move(refresh)); },
+            [f=std::move(f)] (auto&& r) {return detail::make_response(f(std::move(r)));},
+            options.ttl, options.stale_while_revalidate, options.max_bytes, options.vary);
+        has_cached_routes_ = true;
+        registry_.add(http::verb::get, uri_regex,
+            detail::AsyncHttpHandler([cache](http::request<http::string_body>&& req, boost::asio::yield_context yield) {
+                return (*cache)(std::move(req), yield);
+            }));
+    }
+
+    // Sizes the pool running the background refreshes of every cached
+    // route. Must be called before start()/run().
+    void set_cache_refresh_threads(unsigned nb_threads)
+    {
+        refresh_threads_ = nb_threads;
+    }
+
+    // Registers a fixed response, serialized once here and written as-is on
+    // every hit. Accepts anything add_http_handler callbacks may return.
+    template<class R>
+    void add_static_response(http::verb v, boost::beast::string_view uri_regex, R&& r)
+    {
+        registry_.add(v, uri_regex, detail::StaticResponse(detail::make_response(std::forward<R>(r))));
+    }
+
     void add_ws_handler(boost::beast::string_view uri_regex, detail::WebSocketHandler f)
     {
         registry_.add(http::verb::get, uri_regex, std::move(f));
@@ -128,6 +217,8 @@ public:
 
     void start(unsigned nb_threads=1)
     {
+        open_file_reader();
+        open_refresh_pool();
         for(auto i = nb_threads; i > 0; --i)
         {
             threads.emplace_back([&]
@@ -145,6 +236,8 @@ public:
 
     void run()
     {
+        open_file_reader();
+        open_refresh_pool();
         ioc.run();
     }
 
@@ -153,8 +246,270 @@ public:
         ioc.stop();
     }
 
+    // Sends msg to every WebSocket session, across all the workers when
+    // running in prefork mode. There, messages over
+    // detail::MAX_BROADCAST_SIZE (1 MB) are dropped and logged.
+    void broadcast(std::string_view msg)
+    {
+#ifdef __linux__
+        if(ring_)
+        {
+            try {
+                ring_->publish(msg);
+            } catch(const std::length_error& e) {
+                std::cerr << "broadcast: " << e.what() << std::endl;
+            }
+            return;
+        }
+#endif
+        deliver(msg);
+    }
+
+#ifdef __linux__
+    // Prefork mode, replacing start()/run(): forks nb_workers processes that
+    // each run this server on nb_threads threads and accept on the sockets
+    // bound by listen(). If one of the first workers dies within
+    // WORKER_MIN_LIFETIME of startup, the others are stopped and a
+    // std::runtime_error is thrown. Workers that crash later are respawned,
+    // after a delay doubling from WORKER_RESPAWN_DELAY up to
+    // WORKER_MAX_RESPAWN_DELAY while the same worker keeps crashing within
+    // WORKER_MAX_RESPAWN_DELAY of being respawned.
+    // SIGTERM or SIGINT sent to the supervisor is forwarded to the workers
+    // as SIGTERM; they stop like stop() and exit, and run_workers() returns
+    // once they are all gone. Only the workers are reaped, other children of
+    // the process are left alone. Throws std::runtime_error on targets
+    // without lock-free 64-bit atomics. Linux only.
+    void run_workers(unsigned nb_workers, unsigned nb_threads=1)
+    {
+        using clock = std::chrono::steady_clock;
+        ring_ = std::make_unique<detail::BroadcastRing>(nb_workers);
+
+        // Signals are only taken synchronously, through sigtimedwait(), so
+        // none can slip in between checking for them and waiting.
+        sigset_t signals, previous;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGTERM);
+        sigaddset(&signals, SIGINT);
+        ::pthread_sigmask(SIG_BLOCK, &signals, &previous);
+
+        std::map<pid_t, Worker> workers;
+        std::map<unsigned, clock::time_point> respawns;     // worker index -> when
+        std::vector<std::chrono::milliseconds> delays(nb_workers, std::chrono::milliseconds{0});
+        bool stopping = false;
+        bool failed = false;
+        auto stop_workers = [&] {
+            stopping = true;
+            respawns.clear();
+            for(auto& w: workers) ::kill(w.first, SIGTERM);
+        };
+
+        auto on_exit = [&](pid_t pid, const Worker& worker, int status) {
+            if(stopping || (WIFEXITED(status) && WEXITSTATUS(status) == 0)) return;
+
+            auto now = clock::now();
+            auto lifetime = now - worker.started;
+            if(worker.initial && lifetime < WORKER_MIN_LIFETIME)
+            {
+                failed = true;
+                return stop_workers();
+            }
+            auto& delay = delays[worker.index];
+            if(delay.count() == 0 || lifetime >= WORKER_MAX_RESPAWN_DELAY)
+                delay = WORKER_RESPAWN_DELAY;
+            else
+                delay = std::min(delay * 2, WORKER_MAX_RESPAWN_DELAY);
+            std::cerr << "worker " << pid << " died, respawning in " << delay.count() << " ms" << std::endl;
+            respawns[worker.index] = now + delay;
+        };
+
+        try {
+            for(unsigned i = 0; i < nb_workers; ++i)
+                workers.emplace(spawn_worker(i, nb_threads, previous), Worker{i, clock::now(), true});
+
+            while(!workers.empty() || !respawns.empty())
+            {
+                for(auto it = workers.begin(); it != workers.end();)
+                {
+                    int status;
+                    pid_t pid = ::waitpid(it->first, &status, WNOHANG);
+                    if(pid < 0)
+                        throw std::system_error(errno, std::generic_category(), "waitpid");
+                    if(pid == 0)
+                    {
+                        ++it;
+                        continue;
+                    }
+                    auto worker = it->second;
+                    it = workers.erase(it);
+                    on_exit(pid, worker, status);
+                }
+
+                auto now = clock::now();
+                for(auto it = respawns.begin(); it != respawns.end();)
+                {
+                    if(it->second > now)
+                    {
+                        ++it;
+                        continue;
+                    }
+                    workers.emplace(spawn_worker(it->first, nb_threads, previous),
+                                    Worker{it->first, clock::now(), false});
+                    it = respawns.erase(it);
+                }
+
+                timespec timeout{0, 100 * 1000 * 1000};
+                int sig = ::sigtimedwait(&signals, nullptr, &timeout);
+                if((sig == SIGTERM || sig == SIGINT) && !stopping)
+                    stop_workers();
+            }
+        } catch(...) {
+            stop_workers();
+            reap_workers(workers);
+            ::pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+            throw;
+        }
+
+        ::pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+        if(failed)
+            throw std::runtime_error("a worker died right after being spawned");
+    }
+#endif
+
 private:
 
+#ifdef __linux__
+    static constexpr std::chrono::milliseconds WORKER_MIN_LIFETIME{1000};
+    static constexpr std::chrono::milliseconds WORKER_RESPAWN_DELAY{100};
+    static constexpr std::chrono::milliseconds WORKER_MAX_RESPAWN_DELAY{10000};
+    static constexpr std::chrono::milliseconds WORKER_STOP_TIMEOUT{5000};
+    static constexpr std::chrono::milliseconds BROADCAST_RETRY_INTERVAL{1};
+#endif
+
+    void open_file_reader()
+    {
+        if(file_reader_) return;
+#ifdef CRITTER_HAS_IO_URING
+        auto backend = file_io_;
+        if(backend == FileIo::automatic)
+            backend = detail::io_uring_supported() ? FileIo::io_uring : FileIo::thread_pool;
+        if(backend == FileIo::io_uring)
+        {
+            file_reader_ = std::make_unique<detail::UringFileReader>(ioc.get_executor(), file_io_threads_);
+            return;
+        }
+#endif
+        file_reader_ = std::make_unique<detail::ThreadPoolFileReader>(file_io_threads_);
+    }
+
+    // Runs the stale-while-revalidate refreshes of the cached routes, off
+    // the io_context threads.
+    void open_refresh_pool()
+    {
+        if(!refresh_pool_ && has_cached_routes_)
+            refresh_pool_ = std::make_unique<boost::asio::thread_pool>(refresh_threads_);
+    }
+
+#ifdef __linux__
+    struct Worker
+    {
+        unsigned index;
+        std::chrono::steady_clock::time_point started;
+        bool initial;   // spawned at startup rather than respawned
+    };
+
+    // Waits for the workers, already sent SIGTERM, to exit. Those still
+    // running after WORKER_STOP_TIMEOUT are killed.
+    static void reap_workers(std::map<pid_t, Worker>& workers)
+    {
+        auto deadline = std::chrono::steady_clock::now() + WORKER_STOP_TIMEOUT;
+        while(!workers.empty())
+        {
+            bool killing = std::chrono::steady_clock::now() >= deadline;
+            for(auto it = workers.begin(); it != workers.end();)
+            {
+                if(killing) ::kill(it->first, SIGKILL);
+                int status;
+                if(::waitpid(it->first, &status, killing ? 0 : WNOHANG) == 0)
+                    ++it;
+                else
+                    it = workers.erase(it);     // reaped, or not our child any more
+            }
+            if(!workers.empty())
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    // Forks a worker. In the child, runs the server until it is stopped
+    // and exits without returning.
+    pid_t spawn_worker(unsigned index, unsigned nb_threads, const sigset_t& sigmask)
+    {
+        // Nothing buffered may be flushed twice, by the child and the parent
+        std::fflush(nullptr);
+        pid_t supervisor = ::getpid();
+        ioc.notify_fork(boost::asio::io_context::fork_prepare);
+        pid_t pid = ::fork();
+        if(pid < 0)
+            throw std::system_error(errno, std::generic_category(), "fork");
+        if(pid > 0)
+        {
+            ioc.notify_fork(boost::asio::io_context::fork_parent);
+            return pid;
+        }
+
+        ioc.notify_fork(boost::asio::io_context::fork_child);
+        ::prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if(::getppid() != supervisor)
+            ::_exit(0);     // the supervisor died before prctl
+        boost::asio::signal_set stop_signals(ioc, SIGTERM, SIGINT);
+        stop_signals.async_wait([this](auto, int) { stop(); });
+        ::pthread_sigmask(SIG_SETMASK, &sigmask, nullptr);
+        boost::asio::spawn(ioc,
+            std::bind(&WebServer::do_drain_broadcasts, this, index, std::placeholders::_1));
+        start(nb_threads);
+        std::for_each(begin(threads), end(threads), [](auto& t) {t.join();});
+        std::fflush(nullptr);
+        ::_exit(0);
+    }
+
+    // Delivers the messages of the shared ring to this worker's sessions,
+    // waking up when the ring's eventfd for this worker is signalled.
+    void do_drain_broadcasts(unsigned index, boost::asio::yield_context yield)
+    {
+        boost::system::error_code ec;
+        boost::asio::posix::stream_descriptor events(ioc, ::dup(ring_->event_fd(index)));
+        boost::asio::steady_timer timer(ioc);
+        auto reader = ring_->make_reader();
+        for(;;)
+        {
+            bool pending = ring_->drain(reader, [this](std::string_view msg) { deliver(msg); });
+            if(pending)
+            {
+                timer.expires_after(BROADCAST_RETRY_INTERVAL);
+                timer.async_wait(yield[ec]);
+            }
+            else
+            {
+                std::uint64_t count;
+                events.async_read_some(boost::asio::buffer(&count, sizeof(count)), yield[ec]);
+            }
+            if(ec)
+                return fail(ec, "broadcast");
+        }
+    }
+#endif
+
+    void deliver(std::string_view msg)
+    {
+        for(auto& session: get_ws_sessions())
+        {
+            try {
+                session->send(msg);
+            } catch(const std::exception& e) {
+                std::cerr << "broadcast: " << e.what() << std::endl;
+            }
+        }
+    }
+
     // Returns a not found response
     auto not_found(http::request<http::string_body>& req)
     {
@@ -213,7 +568,7 @@ private:
             http::response<http::string_body> response;
             try
             {
-                auto handler = registry_.get(req.method(), req.target());
+                const auto& handler = registry_.get(req.method(), req.target());
                 if(websocket::is_upgrade(req))
                 {
                     auto session = std::make_shared<detail::WebSocketSessionImpl<StreamClass>>(std::move(stream),
@@ -225,10 +580,21 @@ private:
                     session->run(std::move(req), yield);
                     return;
                 }
+                else if(auto fixed = std::get_if<detail::StaticResponse>(&handler))
+                {
+                    auto keep_alive = req.keep_alive();
+                    boost::asio::async_write(stream, fixed->buffer(keep_alive), yield[ec]);
+                    if(ec) return fail(ec, "write");
+                    if(!keep_alive) break;
+                    continue;
+                }
                 else
                 {
                     try {
-                        response = std::get<detail::HttpHandler>(handler)(std::move(req));
+                        if(auto async_handler = std::get_if<detail::AsyncHttpHandler>(&handler))
+                            response = (*async_handler)(std::move(req), yield);
+                        else
+                            response = std::get<detail::HttpHandler>(handler)(std::move(req));
                     } catch (const HttpException&) {
                         throw;
                     } catch (const std::exception& e) {
@@ -267,11 +633,7 @@ private:
         }
     }
 
-    template<class StreamClass>
-    void do_listen(
-        boost::asio::io_context& ioc,
-        tcp::endpoint endpoint,
-        boost::asio::yield_context yield)
+    tcp::acceptor open_acceptor(tcp::endpoint endpoint)
     {
         boost::system::error_code ec;
 
@@ -293,9 +655,19 @@ private:
         if(ec)
             throw boost::system::system_error(ec);
 
+        return acceptor;
+    }
+
+    template<class StreamClass>
+    void do_listen(
+        tcp::acceptor& acceptor,
+        boost::asio::yield_context yield)
+    {
+        boost::system::error_code ec;
+
         for(;;)
         {
-            tcp::socket socket(ioc);
+            tcp::socket socket(acceptor.get_executor());
             acceptor.async_accept(socket, yield[ec]);
             if(ec)
                 fail(ec, "accept");
@@ -335,6 +707,16 @@ private:
     }
 
     boost::asio::io_context ioc;
+    // Declared after ioc: pending reads and refreshes hold work on it until they are destroyed.
+    std::unique_ptr<detail::FileReader> file_reader_;
+    std::unique_ptr<boost::asio::thread_pool> refresh_pool_;
+    unsigned refresh_threads_ = 2;
+    bool has_cached_routes_ = false;
+    FileIo file_io_ = FileIo::automatic;
+    unsigned file_io_threads_ = 2;
+#ifdef __linux__
+    std::unique_ptr<detail::BroadcastRing> ring_;
+#endif
     ssl::context ctx{ssl::context::tlsv12};
     std::vector<std::thread> threads;
     detail::Registry registry_;